@@ -0,0 +1,40 @@
+#!/bin/sh
+# Measures how long the daemon takes from a cold launch until its main loop is running, and its
+# resident memory once idle. Needs the system bus and BlueZ, and root to create the uinput device
+# if a gamepad is connected. Time to first input is logged by the daemon itself ("First input ...").
+#
+# Usage: bench/startup.sh [path/to/skylanders-gamepad-daemon] [runs]
+
+DAEMON=${1:-build/skylanders-gamepad-daemon}
+RUNS=${2:-10}
+LOG=$(mktemp)
+trap 'rm -f "$LOG"' EXIT
+
+total_ms=0
+for run in $(seq "$RUNS"); do
+    start=$(date +%s%N)
+    "$DAEMON" --idle-timeout=60 >"$LOG" 2>&1 &
+    pid=$!
+
+    # Wait for the main loop to start
+    while ! grep -q "Daemon running" "$LOG"; do
+        if ! kill -0 "$pid" 2>/dev/null; then
+            echo "Daemon exited early:" >&2
+            cat "$LOG" >&2
+            exit 1
+        fi
+        sleep 0.001
+    done
+    ready=$(date +%s%N)
+
+    sleep 1
+    rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$pid/status")
+    kill -TERM "$pid"
+    wait "$pid"
+
+    ms=$(( (ready - start) / 1000000 ))
+    total_ms=$(( total_ms + ms ))
+    echo "run $run: ready in ${ms} ms, idle RSS ${rss} kB ($(grep -o 'ready [0-9.]* ms after launch' "$LOG"))"
+done
+
+echo "average: ready in $(( total_ms / RUNS )) ms over $RUNS runs"
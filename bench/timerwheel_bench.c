@@ -0,0 +1,78 @@
+// Measures timer wheel overhead with many turbo buttons active at once.
+// Every entry behaves like a turbo button: it reschedules itself half a period after each fire.
+// The wheel is driven the same way the daemon drives it from the timerfd, one wakeup per deadline.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "timerwheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SIMULATED_MS (60 * 1000)
+
+typedef struct {
+    TimerWheelEntry timer;
+    unsigned int half_period;
+} BenchTurbo;
+
+static TimerWheel wheel;
+static unsigned long fires = 0;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_fire(TimerWheelEntry *entry, void *user_data) {
+    BenchTurbo *turbo = user_data;
+    fires++;
+    timer_wheel_schedule(&wheel, entry, entry->expires + turbo->half_period);
+}
+
+static void run(unsigned int count) {
+    BenchTurbo *turbos = calloc(count, sizeof(*turbos));
+    if (!turbos) {
+        perror("calloc");
+        exit(1);
+    }
+
+    timer_wheel_init(&wheel, 0);
+    fires = 0;
+
+    double start = now_seconds();
+    for (unsigned int i = 0; i < count; i++) {
+        // Periods between 16ms and 200ms, staggered start
+        turbos[i].half_period = (16 + (i * 37) % 185) / 2;
+        timer_wheel_entry_init(&turbos[i].timer, on_fire, &turbos[i]);
+        timer_wheel_schedule(&wheel, &turbos[i].timer, 1 + i % 97);
+    }
+    double scheduled = now_seconds();
+
+    unsigned long wakeups = 0;
+    uint64_t deadline;
+    while (timer_wheel_next_deadline(&wheel, &deadline) && deadline <= SIMULATED_MS) {
+        timer_wheel_advance(&wheel, deadline);
+        wakeups++;
+    }
+    double end = now_seconds();
+
+    printf("%8u turbos: schedule %6.1f ns/entry, %10lu fires in %6.1f simulated s, %7.1f ns/fire, %6lu wakeups\n",
+           count,
+           (scheduled - start) * 1e9 / count,
+           fires, SIMULATED_MS / 1000.0,
+           fires ? (end - scheduled) * 1e9 / fires : 0.0,
+           wakeups);
+
+    free(turbos);
+}
+
+int main(void) {
+    static const unsigned int counts[] = { 1, 14, 100, 1000, 10000, 100000 };
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        run(counts[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,462 @@
+// Statistics and control interface on the system bus
+
+#include "bus.h"
+#include "gamepad.h"
+#include <string.h>
+
+static const char introspection_xml[] =
+    "<node>"
+    "  <interface name='" BUS_DAEMON_INTERFACE "'>"
+    "    <property name='Pads' type='ao' access='read'>"
+    "      <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+    "    </property>"
+    "  </interface>"
+    "  <interface name='" BUS_PAD_INTERFACE "'>"
+    "    <annotation name='org.freedesktop.DBus.Property.EmitsChangedSignal' value='false'/>"
+    "    <method name='Reconnect'/>"
+    "    <method name='RestartNotify'/>"
+    "    <property name='DevicePath' type='o' access='read'/>"
+    "    <property name='ConnectionStage' type='s' access='read'/>"
+    "    <property name='ReportsReceived' type='t' access='read'/>"
+    "    <property name='ReportsPerSecond' type='u' access='read'/>"
+    "    <property name='EventsEmitted' type='t' access='read'/>"
+    "    <property name='DuplicatesSkipped' type='t' access='read'/>"
+    "    <property name='MillisecondsSinceLastReport' type='t' access='read'/>"
+    "  </interface>"
+    "</node>";
+
+static const char *stage_names[] = {
+    [STAGE_SUBSCRIBING] = "subscribing",
+    [STAGE_READY] = "ready",
+    [STAGE_RECONNECTING] = "reconnecting",
+    [STAGE_NOTIFY_FAILED] = "notify-failed",
+};
+
+static GDBusNodeInfo *node_info = NULL;
+static guint owner_id = 0;
+static guint daemon_registration_id = 0;
+static guint pads_registration_id = 0;
+
+static void on_name_acquired(GDBusConnection *connection, const gchar *name, gpointer user_data) {
+    (void)connection; (void)user_data;
+    g_message("Acquired bus name %s\n", name);
+}
+
+static void on_name_lost(GDBusConnection *connection, const gchar *name, gpointer user_data) {
+    (void)connection; (void)user_data;
+    // Not fatal, the gamepad still works without the statistics interface
+    g_warning("Could not own bus name %s, is the D-Bus policy installed?\n", name);
+}
+
+static GVariant *get_daemon_property(GDBusConnection *connection,
+                                     const gchar *sender,
+                                     const gchar *object_path,
+                                     const gchar *interface_name,
+                                     const gchar *property_name,
+                                     GError **error,
+                                     gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)interface_name; (void)error; (void)user_data;
+
+    if (strcmp(property_name, "Pads") != 0) {
+        return NULL;
+    }
+
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("ao"));
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, subscriptions);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GamepadSubscription *sub = value;
+        if (sub->object_path) {
+            g_variant_builder_add(&builder, "o", sub->object_path);
+        }
+    }
+    return g_variant_builder_end(&builder);
+}
+
+// Reports in the last complete second, worked out from the counters the report path keeps
+static guint reports_per_second(const GamepadSubscription *sub) {
+    gint64 second = g_get_monotonic_time() / G_USEC_PER_SEC;
+
+    if (second == sub->rate_second) {
+        return sub->rate_previous;
+    }
+    if (second == sub->rate_second + 1) {
+        return sub->rate_current;
+    }
+    return 0;
+}
+
+static GVariant *get_pad_property(GDBusConnection *connection,
+                                  const gchar *sender,
+                                  const gchar *object_path,
+                                  const gchar *interface_name,
+                                  const gchar *property_name,
+                                  GError **error,
+                                  gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)interface_name; (void)error;
+    GamepadSubscription *sub = user_data;
+
+    if (strcmp(property_name, "DevicePath") == 0) {
+        return g_variant_new_object_path(sub->device_path);
+    } else if (strcmp(property_name, "ConnectionStage") == 0) {
+        return g_variant_new_string(stage_names[sub->stage]);
+    } else if (strcmp(property_name, "ReportsReceived") == 0) {
+        return g_variant_new_uint64(sub->reports_received);
+    } else if (strcmp(property_name, "ReportsPerSecond") == 0) {
+        return g_variant_new_uint32(reports_per_second(sub));
+    } else if (strcmp(property_name, "EventsEmitted") == 0) {
+        // There is a single virtual gamepad, recreated on every connection, so its count is this pad's
+        return g_variant_new_uint64(events_emitted);
+    } else if (strcmp(property_name, "DuplicatesSkipped") == 0) {
+        return g_variant_new_uint64(sub->duplicates_skipped);
+    } else if (strcmp(property_name, "MillisecondsSinceLastReport") == 0) {
+        return g_variant_new_uint64((g_get_monotonic_time() - sub->last_report_time) / 1000);
+    }
+    return NULL;
+}
+
+// A reconnect that failed part way leaves the pad as it was, if it is still around
+static void restore_ready_stage(const char *device_path) {
+    GamepadSubscription *sub = g_hash_table_lookup(subscriptions, device_path);
+    if (sub && sub->stage == STAGE_RECONNECTING) {
+        sub->stage = STAGE_READY;
+    }
+}
+
+static void on_reconnect_connected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    char *path = user_data;
+    GError *error = NULL;
+
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (!result) {
+        g_warning("Reconnecting %s failed: %s\n", path, error->message);
+        g_error_free(error);
+        restore_ready_stage(path);
+    } else {
+        g_variant_unref(result);
+        // We stopped watching the device when it dropped, so pick it back up like a new connection
+        if (!device_connected) {
+            device_path = find_gamepad_device_path();
+            if (device_path != NULL) {
+                handle_device_connection_change(TRUE);
+            }
+        }
+    }
+    g_free(path);
+}
+
+static void on_reconnect_disconnected(GObject *source, GAsyncResult *res, gpointer user_data) {
+    char *path = user_data;
+    GError *error = NULL;
+
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (!result) {
+        // Still connected, so there is nothing to reconnect
+        g_warning("Disconnecting %s for reconnect failed: %s\n", path, error->message);
+        g_error_free(error);
+        restore_ready_stage(path);
+        g_free(path);
+        return;
+    }
+    g_variant_unref(result);
+
+    g_message("Reconnecting %s\n", path);
+    g_dbus_connection_call(conn,
+        "org.bluez",
+        path,
+        "org.bluez.Device1",
+        "Connect",
+        NULL,
+        NULL,
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        on_reconnect_connected,
+        path);
+}
+
+// RestartNotify runs asynchronously so reports, turbo timers and property reads keep flowing meanwhile
+typedef struct {
+    GDBusMethodInvocation *invocation;
+    char *device_path;
+    char *char_path;
+} RestartNotifyRequest;
+
+static void restart_notify_request_free(RestartNotifyRequest *request) {
+    g_free(request->device_path);
+    g_free(request->char_path);
+    g_free(request);
+}
+
+static void on_restart_notify_started(GObject *source, GAsyncResult *res, gpointer user_data) {
+    RestartNotifyRequest *request = user_data;
+    GError *error = NULL;
+
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    // The pad may have disconnected while we waited
+    GamepadSubscription *sub = g_hash_table_lookup(subscriptions, request->device_path);
+
+    if (!result) {
+        g_warning("StartNotify failed: %s\n", error->message);
+        if (sub && sub->stage == STAGE_SUBSCRIBING) {
+            sub->stage = STAGE_NOTIFY_FAILED;
+        }
+        g_dbus_method_invocation_take_error(request->invocation, error);
+    } else {
+        g_variant_unref(result);
+        if (sub && sub->stage == STAGE_SUBSCRIBING) {
+            sub->stage = STAGE_READY;
+        }
+        g_dbus_method_invocation_return_value(request->invocation, NULL);
+    }
+    restart_notify_request_free(request);
+}
+
+static void on_restart_notify_stopped(GObject *source, GAsyncResult *res, gpointer user_data) {
+    RestartNotifyRequest *request = user_data;
+
+    // Failing here just means notifications weren't on
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, NULL);
+    if (result) {
+        g_variant_unref(result);
+    }
+
+    g_dbus_connection_call(conn,
+        "org.bluez",
+        request->char_path,
+        "org.bluez.GattCharacteristic1",
+        "StartNotify",
+        NULL,
+        NULL,
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        on_restart_notify_started,
+        request);
+}
+
+static void handle_pad_method_call(GDBusConnection *connection,
+                                   const gchar *sender,
+                                   const gchar *object_path,
+                                   const gchar *interface_name,
+                                   const gchar *method_name,
+                                   GVariant *parameters,
+                                   GDBusMethodInvocation *invocation,
+                                   gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)interface_name; (void)parameters;
+    GamepadSubscription *sub = user_data;
+
+    if (strcmp(method_name, "Reconnect") == 0) {
+        g_message("Reconnect requested for %s\n", sub->device_path);
+        sub->stage = STAGE_RECONNECTING;
+        // The subscription (and this object) goes away once BlueZ reports the disconnect
+        g_dbus_connection_call(conn,
+            "org.bluez",
+            sub->device_path,
+            "org.bluez.Device1",
+            "Disconnect",
+            NULL,
+            NULL,
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            on_reconnect_disconnected,
+            g_strdup(sub->device_path));
+        g_dbus_method_invocation_return_value(invocation, NULL);
+    } else if (strcmp(method_name, "RestartNotify") == 0) {
+        if (!char_path) {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                  "No characteristic for %s", sub->device_path);
+            return;
+        }
+
+        if (sub->stage != STAGE_READY && sub->stage != STAGE_NOTIFY_FAILED) {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                  "%s is busy (%s)", sub->device_path, stage_names[sub->stage]);
+            return;
+        }
+
+        g_message("Restarting notifications on %s\n", char_path);
+        sub->stage = STAGE_SUBSCRIBING;
+
+        RestartNotifyRequest *request = g_new0(RestartNotifyRequest, 1);
+        request->invocation = invocation;
+        request->device_path = g_strdup(sub->device_path);
+        request->char_path = g_strdup(char_path);
+
+        // BlueZ refuses StartNotify while already notifying, so stop first. The reply is sent once it has started again.
+        g_dbus_connection_call(conn,
+            "org.bluez",
+            request->char_path,
+            "org.bluez.GattCharacteristic1",
+            "StopNotify",
+            NULL,
+            NULL,
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            on_restart_notify_stopped,
+            request);
+    }
+}
+
+static GamepadSubscription *find_pad(const gchar *node) {
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, subscriptions);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GamepadSubscription *sub = value;
+        if (sub->object_path && strcmp(strrchr(sub->object_path, '/') + 1, node) == 0) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+static const GDBusInterfaceVTable pad_vtable;
+
+// Pads are a subtree under BUS_PADS_PATH so introspecting (and busctl tree) lists one child node per pad
+static gchar **enumerate_pads(GDBusConnection *connection, const gchar *sender, const gchar *object_path, gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)user_data;
+
+    GPtrArray *nodes = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, subscriptions);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GamepadSubscription *sub = value;
+        if (sub->object_path) {
+            g_ptr_array_add(nodes, g_strdup(strrchr(sub->object_path, '/') + 1));
+        }
+    }
+    g_ptr_array_add(nodes, NULL);
+    return (gchar **)g_ptr_array_free(nodes, FALSE);
+}
+
+static GDBusInterfaceInfo **introspect_pad(GDBusConnection *connection,
+                                           const gchar *sender,
+                                           const gchar *object_path,
+                                           const gchar *node,
+                                           gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)user_data;
+
+    if (!node || !find_pad(node)) {
+        return NULL;
+    }
+    GDBusInterfaceInfo **interfaces = g_new0(GDBusInterfaceInfo *, 2);
+    interfaces[0] = g_dbus_interface_info_ref(g_dbus_node_info_lookup_interface(node_info, BUS_PAD_INTERFACE));
+    return interfaces;
+}
+
+static const GDBusInterfaceVTable *dispatch_pad(GDBusConnection *connection,
+                                                const gchar *sender,
+                                                const gchar *object_path,
+                                                const gchar *interface_name,
+                                                const gchar *node,
+                                                gpointer *out_user_data,
+                                                gpointer user_data) {
+    (void)connection; (void)sender; (void)object_path; (void)user_data;
+
+    GamepadSubscription *sub = node ? find_pad(node) : NULL;
+    if (!sub || strcmp(interface_name, BUS_PAD_INTERFACE) != 0) {
+        return NULL;
+    }
+    *out_user_data = sub;
+    return &pad_vtable;
+}
+
+static const GDBusSubtreeVTable pads_vtable = {
+    .enumerate = enumerate_pads,
+    .introspect = introspect_pad,
+    .dispatch = dispatch_pad,
+};
+
+static const GDBusInterfaceVTable daemon_vtable = {
+    .method_call = NULL,
+    .get_property = get_daemon_property,
+    .set_property = NULL,
+};
+
+static const GDBusInterfaceVTable pad_vtable = {
+    .method_call = handle_pad_method_call,
+    .get_property = get_pad_property,
+    .set_property = NULL,
+};
+
+void bus_init(void) {
+    GError *error = NULL;
+
+    node_info = g_dbus_node_info_new_for_xml(introspection_xml, &error);
+    if (!node_info) {
+        g_error("Failed to parse introspection data: %s\n", error->message);
+        g_error_free(error);
+        return;
+    }
+
+    daemon_registration_id = g_dbus_connection_register_object(conn,
+        BUS_OBJECT_PATH,
+        g_dbus_node_info_lookup_interface(node_info, BUS_DAEMON_INTERFACE),
+        &daemon_vtable,
+        NULL,
+        NULL,
+        &error);
+    if (!daemon_registration_id) {
+        g_warning("Failed to export %s: %s\n", BUS_OBJECT_PATH, error->message);
+        g_error_free(error);
+    }
+
+    pads_registration_id = g_dbus_connection_register_subtree(conn,
+        BUS_PADS_PATH,
+        &pads_vtable,
+        G_DBUS_SUBTREE_FLAGS_NONE,
+        NULL,
+        NULL,
+        &error);
+    if (!pads_registration_id) {
+        g_warning("Failed to export %s: %s\n", BUS_PADS_PATH, error->message);
+        g_error_free(error);
+    }
+
+    owner_id = g_bus_own_name_on_connection(conn,
+        BUS_NAME,
+        G_BUS_NAME_OWNER_FLAGS_NONE,
+        on_name_acquired,
+        on_name_lost,
+        NULL,
+        NULL);
+}
+
+void bus_shutdown(void) {
+    if (owner_id) {
+        g_bus_unown_name(owner_id);
+        owner_id = 0;
+    }
+    if (daemon_registration_id) {
+        g_dbus_connection_unregister_object(conn, daemon_registration_id);
+        daemon_registration_id = 0;
+    }
+    if (pads_registration_id) {
+        g_dbus_connection_unregister_subtree(conn, pads_registration_id);
+        pads_registration_id = 0;
+    }
+    g_clear_pointer(&node_info, g_dbus_node_info_unref);
+}
+
+void bus_export_pad(GamepadSubscription *sub) {
+    if (!pads_registration_id) {
+        return;
+    }
+
+    // BlueZ device paths end in dev_AA_BB_CC_DD_EE_FF, which is a valid object path element as is.
+    // The subtree picks the pad up from here, nothing else to register.
+    char *name = g_path_get_basename(sub->device_path);
+    sub->object_path = g_strdup_printf("%s/%s", BUS_PADS_PATH, name);
+    g_free(name);
+}
+
+void bus_unexport_pad(GamepadSubscription *sub) {
+    g_clear_pointer(&sub->object_path, g_free);
+}
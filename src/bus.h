@@ -0,0 +1,21 @@
+#ifndef SKYLANDERS_BUS_H
+#define SKYLANDERS_BUS_H
+
+#include "main.h"
+
+// --- Constants ---
+#define BUS_NAME "io.github.FifthTundraG.SkylandersGamepadDaemon"
+#define BUS_OBJECT_PATH "/io/github/FifthTundraG/SkylandersGamepadDaemon"
+#define BUS_PADS_PATH BUS_OBJECT_PATH "/Pad"
+#define BUS_DAEMON_INTERFACE BUS_NAME ".Daemon"
+#define BUS_PAD_INTERFACE BUS_NAME ".Pad"
+
+// Own BUS_NAME on the system bus and export the daemon object
+void bus_init(void);
+void bus_shutdown(void);
+
+// One object per connected pad, under BUS_PADS_PATH
+void bus_export_pad(GamepadSubscription *sub);
+void bus_unexport_pad(GamepadSubscription *sub);
+
+#endif // SKYLANDERS_BUS_H
@@ -1,13 +1,25 @@
 #include "gamepad.h"
+#include "turbo.h"
 #include <stdio.h>
 #include <libevdev/libevdev-uinput.h>
 #include <stdint.h>
 
 struct libevdev_uinput *uidev = NULL;
+guint64 events_emitted = 0; // since the virtual gamepad was created, not counting syncs
 
-static void write_event(const unsigned int type, const unsigned int code, const int value) {
+void write_event(const unsigned int type, const unsigned int code, const int value) {
     if (uidev) {
         libevdev_uinput_write_event(uidev, type, code, value);
+        if (type != EV_SYN) {
+            events_emitted++;
+        }
+    }
+}
+
+// Button edges go through the turbo/macro engine first, which may take them over
+static void emit_button(const unsigned int code, const int value) {
+    if (!turbo_handle_button(code, value)) {
+        write_event(EV_KEY, code, value);
     }
 }
 
@@ -57,12 +69,14 @@ void setup_virtual_gamepad(void) {
     }
 
     libevdev_free(dev);
+    events_emitted = 0;
     g_message("Virtual gamepad created at %s\n", libevdev_uinput_get_devnode(uidev));
 }
 
 void cleanup_virtual_gamepad(void) {
     if (uidev) {
         g_message("Removing virtual gamepad\n");
+        turbo_reset();
         libevdev_uinput_destroy(uidev);
         uidev = NULL;
     }
@@ -82,29 +96,29 @@ void process_gamepad_data(const guchar *data) {
     static uint16_t prev_buttons = 0;
     uint16_t changed = buttons ^ prev_buttons;
     
-    if (changed & BUTTON_A_MASK) write_event(EV_KEY, BTN_A, (buttons & BUTTON_A_MASK) ? 1 : 0);
-    if (changed & BUTTON_B_MASK) write_event(EV_KEY, BTN_B, (buttons & BUTTON_B_MASK) ? 1 : 0);
-    if (changed & BUTTON_X_MASK) write_event(EV_KEY, BTN_X, (buttons & BUTTON_X_MASK) ? 1 : 0);
-    if (changed & BUTTON_Y_MASK) write_event(EV_KEY, BTN_Y, (buttons & BUTTON_Y_MASK) ? 1 : 0);
-    if (changed & DPAD_UP_MASK) write_event(EV_KEY, BTN_DPAD_UP, (buttons & DPAD_UP_MASK) ? 1 : 0);
-    if (changed & DPAD_DOWN_MASK) write_event(EV_KEY, BTN_DPAD_DOWN, (buttons & DPAD_DOWN_MASK) ? 1 : 0);
-    if (changed & DPAD_LEFT_MASK) write_event(EV_KEY, BTN_DPAD_LEFT, (buttons & DPAD_LEFT_MASK) ? 1 : 0);
-    if (changed & DPAD_RIGHT_MASK) write_event(EV_KEY, BTN_DPAD_RIGHT, (buttons & DPAD_RIGHT_MASK) ? 1 : 0);
+    if (changed & BUTTON_A_MASK) emit_button(BTN_A, (buttons & BUTTON_A_MASK) ? 1 : 0);
+    if (changed & BUTTON_B_MASK) emit_button(BTN_B, (buttons & BUTTON_B_MASK) ? 1 : 0);
+    if (changed & BUTTON_X_MASK) emit_button(BTN_X, (buttons & BUTTON_X_MASK) ? 1 : 0);
+    if (changed & BUTTON_Y_MASK) emit_button(BTN_Y, (buttons & BUTTON_Y_MASK) ? 1 : 0);
+    if (changed & DPAD_UP_MASK) emit_button(BTN_DPAD_UP, (buttons & DPAD_UP_MASK) ? 1 : 0);
+    if (changed & DPAD_DOWN_MASK) emit_button(BTN_DPAD_DOWN, (buttons & DPAD_DOWN_MASK) ? 1 : 0);
+    if (changed & DPAD_LEFT_MASK) emit_button(BTN_DPAD_LEFT, (buttons & DPAD_LEFT_MASK) ? 1 : 0);
+    if (changed & DPAD_RIGHT_MASK) emit_button(BTN_DPAD_RIGHT, (buttons & DPAD_RIGHT_MASK) ? 1 : 0);
 
     // Shoulders and pause
     static int16_t prev_shoulders = 0;
     int16_t shoulders_changed = shoulders_and_pause ^ prev_shoulders;
-    if (shoulders_changed & PAUSE_MASK) write_event(EV_KEY, BTN_START, (shoulders_and_pause & PAUSE_MASK) ? 1 : 0); // let's have the pause button be our start button, this may change at some point
-    if (shoulders_changed & SHOULDER_LEFT_MASK) write_event(EV_KEY, BTN_TL, (shoulders_and_pause & SHOULDER_LEFT_MASK) ? 1 : 0);
-    if (shoulders_changed & SHOULDER_RIGHT_MASK) write_event(EV_KEY, BTN_TR, (shoulders_and_pause & SHOULDER_RIGHT_MASK) ? 1 : 0);
+    if (shoulders_changed & PAUSE_MASK) emit_button(BTN_START, (shoulders_and_pause & PAUSE_MASK) ? 1 : 0); // let's have the pause button be our start button, this may change at some point
+    if (shoulders_changed & SHOULDER_LEFT_MASK) emit_button(BTN_TL, (shoulders_and_pause & SHOULDER_LEFT_MASK) ? 1 : 0);
+    if (shoulders_changed & SHOULDER_RIGHT_MASK) emit_button(BTN_TR, (shoulders_and_pause & SHOULDER_RIGHT_MASK) ? 1 : 0);
     
     // Triggers (L2/R2)
     static int16_t prev_trigger_l = 0, prev_trigger_r = 0;
     if (trigger_l != prev_trigger_l) {
-        write_event(EV_KEY, BTN_TL2, (trigger_l == TRIGGER_DOWN) ? 1 : 0);
+        emit_button(BTN_TL2, (trigger_l == TRIGGER_DOWN) ? 1 : 0);
     }
     if (trigger_r != prev_trigger_r) {
-        write_event(EV_KEY, BTN_TR2, (trigger_r == TRIGGER_DOWN) ? 1 : 0);
+        emit_button(BTN_TR2, (trigger_r == TRIGGER_DOWN) ? 1 : 0);
     }
     
     // Analog sticks
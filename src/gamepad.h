@@ -20,7 +20,9 @@
 #define TRIGGER_DOWN 0xFF
 
 extern struct libevdev_uinput *uidev;
+extern guint64 events_emitted;
 
+void write_event(const unsigned int type, const unsigned int code, const int value);
 void setup_virtual_gamepad(void);
 void cleanup_virtual_gamepad(void);
 void process_gamepad_data(const guchar *data);
\ No newline at end of file
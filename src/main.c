@@ -7,8 +7,11 @@
 #include <libevdev/libevdev-uinput.h>
 #include <gio/gio.h>
 #include <stdint.h>
+#include <malloc.h>
 #include "main.h"
 #include "gamepad.h"
+#include "turbo.h"
+#include "bus.h"
 
 GDBusConnection *conn = NULL;
 char *device_path = NULL;
@@ -18,9 +21,16 @@ GMainLoop *main_loop = NULL;
 
 GHashTable *subscriptions; // key: device_path, value: GamepadSubscription*
 
+static gint idle_timeout = 0; // seconds without a gamepad before exiting, 0 to never exit
+static guint idle_source_id = 0;
+static gint64 launch_time = 0;
+static gboolean first_input_seen = FALSE;
+
 GamepadSubscription *subscribe_gamepad(const char *device_path) {
     GamepadSubscription *subscription = g_new0(GamepadSubscription, 1);
     subscription->device_path = g_strdup(device_path);
+    subscription->stage = STAGE_SUBSCRIBING;
+    subscription->last_report_time = g_get_monotonic_time();
 
     // Subscribe to characteristic property changes
     subscription->characteristic_properties_changed_id = g_dbus_connection_signal_subscribe(
@@ -32,7 +42,7 @@ GamepadSubscription *subscribe_gamepad(const char *device_path) {
         NULL,
         G_DBUS_SIGNAL_FLAGS_NONE,
         on_characteristic_properties_changed,
-        NULL,
+        subscription,
         NULL);
 
     // Subscribe to device property changes
@@ -48,6 +58,8 @@ GamepadSubscription *subscribe_gamepad(const char *device_path) {
         NULL,
         NULL);
 
+    bus_export_pad(subscription);
+
     return subscription;
 }
 
@@ -55,12 +67,41 @@ void gamepad_subscription_free(GamepadSubscription *sub) {
     if (sub == NULL)
         return;
     
+    bus_unexport_pad(sub);
     g_dbus_connection_signal_unsubscribe(conn, sub->characteristic_properties_changed_id);
     g_dbus_connection_signal_unsubscribe(conn, sub->disconnected_id);
     g_free(sub->device_path);
     g_free(sub);
 }
 
+// Count a report and compare it with the previous one. Returns FALSE for an exact duplicate, which has nothing new to emit.
+gboolean gamepad_subscription_record_report(GamepadSubscription *sub, const guchar *data, gsize size) {
+    gint64 now = g_get_monotonic_time();
+    gint64 second = now / G_USEC_PER_SEC;
+
+    sub->reports_received++;
+    sub->last_report_time = now;
+    if (second != sub->rate_second) {
+        sub->rate_previous = (second == sub->rate_second + 1) ? sub->rate_current : 0;
+        sub->rate_second = second;
+        sub->rate_current = 0;
+    }
+    sub->rate_current++;
+
+    if (size == sub->last_report_size && memcmp(data, sub->last_report, size) == 0) {
+        sub->duplicates_skipped++;
+        return FALSE;
+    }
+
+    if (size <= sizeof(sub->last_report)) {
+        memcpy(sub->last_report, data, size);
+        sub->last_report_size = size;
+    } else {
+        sub->last_report_size = 0; // too big to keep, never treated as a duplicate
+    }
+    return TRUE;
+}
+
 // Find the gamepad device path by scanning BlueZ managed objects for a device with the name DEVICE_NAME and status connected
 char *find_gamepad_device_path(void) {
     g_message("Searching for gamepad device...\n");
@@ -217,7 +258,8 @@ void on_characteristic_properties_changed(GDBusConnection *connection,
                                   const gchar *signal_name,
                                   GVariant *parameters,
                                   gpointer user_data) {
-    (void)connection; (void)sender_name; (void)user_data; // mark as unused
+    (void)connection; (void)sender_name; // mark as unused
+    GamepadSubscription *sub = user_data;
     
     if (strcmp(interface_name, "org.freedesktop.DBus.Properties") != 0 ||
         strcmp(signal_name, "PropertiesChanged") != 0) {
@@ -246,6 +288,13 @@ void on_characteristic_properties_changed(GDBusConnection *connection,
     while (g_variant_iter_loop(changed_properties, "{&sv}", &property_name, &property_value)) {
         if (strcmp(property_name, "Value") == 0) {
             const guchar *data = g_variant_get_data(property_value);
+            if (!first_input_seen) {
+                first_input_seen = TRUE;
+                g_message("First input %.1f ms after launch\n", (g_get_monotonic_time() - launch_time) / 1000.0);
+            }
+            if (sub && !gamepad_subscription_record_report(sub, data, g_variant_get_size(property_value))) {
+                continue; // identical to the last report
+            }
             process_gamepad_data(data);
         }
     }
@@ -312,6 +361,189 @@ void on_bluez_properties_changed(GDBusConnection *connection,
     }
 }
 
+// Rescan BlueZ for our gamepad if we aren't already attached to one
+static void look_for_gamepad(void) {
+    if (device_connected) {
+        return;
+    }
+
+    device_path = find_gamepad_device_path();
+    if (device_path != NULL) {
+        g_message("Found gamepad device at %s\n", device_path);
+        handle_device_connection_change(TRUE);
+    }
+}
+
+// Any BlueZ device changing state. Adapter properties don't change when a device connects, so this is what
+// notices a gamepad connecting after startup, or one whose name or connection wasn't known yet at startup.
+void on_any_device_properties_changed(GDBusConnection *connection,
+                                      const gchar *sender_name,
+                                      const gchar *object_path,
+                                      const gchar *interface_name,
+                                      const gchar *signal_name,
+                                      GVariant *parameters,
+                                      gpointer user_data) {
+    (void)connection; (void)sender_name; (void)interface_name; (void)signal_name; (void)user_data;
+
+    if (device_connected || !g_str_has_prefix(object_path, "/org/bluez/")) {
+        return;
+    }
+
+    const char *iface;
+    GVariantIter *changed_properties;
+    GVariantIter *invalidated_properties;
+
+    g_variant_get(parameters, "(&sa{sv}as)", &iface, &changed_properties, &invalidated_properties);
+
+    const char *property_name;
+    GVariant *property_value;
+    gboolean relevant = FALSE;
+
+    while (g_variant_iter_loop(changed_properties, "{&sv}", &property_name, &property_value)) {
+        if (strcmp(property_name, "Connected") == 0) {
+            relevant |= g_variant_get_boolean(property_value);
+        } else if (strcmp(property_name, "Name") == 0 || strcmp(property_name, "Alias") == 0) {
+            relevant = TRUE;
+        }
+    }
+    g_variant_iter_free(changed_properties);
+    g_variant_iter_free(invalidated_properties);
+
+    if (relevant) {
+        look_for_gamepad();
+    }
+}
+
+// A new object appeared in BlueZ, rescan if it is a device
+void on_bluez_interfaces_added(GDBusConnection *connection,
+                               const gchar *sender_name,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *signal_name,
+                               GVariant *parameters,
+                               gpointer user_data) {
+    (void)connection; (void)sender_name; (void)object_path; (void)interface_name; (void)signal_name; (void)user_data;
+
+    if (device_connected) {
+        return;
+    }
+
+    const char *added_path;
+    GVariant *interfaces;
+    g_variant_get(parameters, "(&o@a{sa{sv}})", &added_path, &interfaces);
+
+    GVariant *device = g_variant_lookup_value(interfaces, "org.bluez.Device1", NULL);
+    g_variant_unref(interfaces);
+    if (device) {
+        g_variant_unref(device);
+        look_for_gamepad();
+    }
+}
+
+// Resident set size in kB, for reporting the idle footprint
+long current_rss_kb(void) {
+    long size = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return -1;
+    }
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(statm);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static gboolean on_idle_timeout(gpointer user_data) {
+    (void)user_data;
+    idle_source_id = 0;
+    g_message("No gamepad for %d seconds, exiting\n", idle_timeout);
+    if (main_loop) {
+        g_main_loop_quit(main_loop);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Start counting down to exit while no gamepad is connected, stop as soon as one is
+void update_idle_timer(void) {
+    if (device_connected) {
+        if (idle_source_id) {
+            g_source_remove(idle_source_id);
+            idle_source_id = 0;
+        }
+        return;
+    }
+
+#ifdef __GLIBC__
+    // Give back whatever the last connection left on the heap before sitting idle
+    malloc_trim(0);
+#endif
+    g_message("Idle, RSS %ld kB\n", current_rss_kb());
+
+    if (idle_timeout > 0 && !idle_source_id) {
+        idle_source_id = g_timeout_add_seconds(idle_timeout, on_idle_timeout, NULL);
+    }
+}
+
+// Wait until BlueZ has resolved the device's GATT services. When it already has (e.g. the daemon was
+// started because the pad connected a while ago) this is a single property read and no wait at all.
+gboolean wait_for_services_resolved(const char *device_path) {
+    gint64 deadline = g_get_monotonic_time() + SERVICES_RESOLVED_TIMEOUT_MS * 1000;
+
+    do {
+        GError *error = NULL;
+        GVariant *result = g_dbus_connection_call_sync(conn,
+            "org.bluez",
+            device_path,
+            "org.freedesktop.DBus.Properties",
+            "Get",
+            g_variant_new("(ss)", "org.bluez.Device1", "ServicesResolved"),
+            G_VARIANT_TYPE("(v)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            -1,
+            NULL,
+            &error);
+
+        if (result) {
+            GVariant *value;
+            g_variant_get(result, "(v)", &value);
+            gboolean resolved = g_variant_get_boolean(value);
+            g_variant_unref(value);
+            g_variant_unref(result);
+            if (resolved) {
+                return TRUE;
+            }
+        } else {
+            g_error_free(error);
+        }
+
+        g_usleep(SERVICES_RESOLVED_POLL_MS * 1000);
+    } while (g_get_monotonic_time() < deadline);
+
+    return FALSE;
+}
+
+// Ask BlueZ to start sending value notifications for the characteristic
+gboolean start_notify(const char *char_path, GError **error) {
+    GVariant *result = g_dbus_connection_call_sync(conn,
+        "org.bluez",
+        char_path,
+        "org.bluez.GattCharacteristic1",
+        "StartNotify",
+        NULL,
+        NULL,
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        error);
+
+    if (!result) {
+        return FALSE;
+    }
+    g_variant_unref(result);
+    return TRUE;
+}
+
 // Handle device connection/disconnection
 void handle_device_connection_change(gboolean connected) {
     if (connected == device_connected) {
@@ -323,10 +555,12 @@ void handle_device_connection_change(gboolean connected) {
     device_connected = connected;
     
     if (connected) {
+        update_idle_timer();
         g_message("Skylanders gamepad connected!\n");
         
-        // Wait a bit for services to resolve
-        g_usleep(2000000); // 2 seconds
+        if (!wait_for_services_resolved(device_path)) {
+            g_warning("Services not resolved after %d ms, trying anyway\n", SERVICES_RESOLVED_TIMEOUT_MS);
+        }
         
         // Find the characteristic
         char_path = find_characteristic_path(device_path, CHARACTERISTIC_UUID);
@@ -344,24 +578,12 @@ void handle_device_connection_change(gboolean connected) {
         g_hash_table_insert(subscriptions, g_strdup(device_path), sub);
 
         GError *error = NULL;
-        GVariant *result = g_dbus_connection_call_sync(conn,
-            "org.bluez",
-            char_path,
-            "org.bluez.GattCharacteristic1",
-            "StartNotify",
-            NULL,
-            NULL,
-            G_DBUS_CALL_FLAGS_NONE,
-            -1,
-            NULL,
-            &error);
-            
-        if (!result) {
+        if (!start_notify(char_path, &error)) {
             g_error("StartNotify failed: %s\n", error->message);
             g_error_free(error);
             return;
         }
-        g_variant_unref(result);
+        sub->stage = STAGE_READY;
         
         g_message("Skylanders gamepad ready!\n");
     } else {
@@ -370,6 +592,7 @@ void handle_device_connection_change(gboolean connected) {
         g_hash_table_remove(subscriptions, device_path);
         device_path = NULL;
         char_path = NULL;
+        update_idle_timer();
     }
 }
 
@@ -425,8 +648,59 @@ void signal_handler(int sig) {
     }
 }
 
+// Parse command line options and set up turbo/macro bindings
+static gboolean parse_options(int *argc, char ***argv, GError **error) {
+    gchar *turbo = NULL;
+    gint turbo_period = TURBO_DEFAULT_PERIOD_MS;
+    gchar *macro_l1 = NULL, *macro_r1 = NULL, *macro_start = NULL;
+
+    GOptionEntry entries[] = {
+        { "turbo", 0, 0, G_OPTION_ARG_STRING, &turbo, "Buttons to auto-repeat while held, optionally with their own period", "A,B:80,..." },
+        { "turbo-period", 0, 0, G_OPTION_ARG_INT, &turbo_period, "Default turbo press + release period (default 100)", "MS" },
+        { "macro-l1", 0, 0, G_OPTION_ARG_STRING, &macro_l1, "Macro played when L1 is pressed", "STEPS" },
+        { "macro-r1", 0, 0, G_OPTION_ARG_STRING, &macro_r1, "Macro played when R1 is pressed", "STEPS" },
+        { "macro-start", 0, 0, G_OPTION_ARG_STRING, &macro_start, "Macro played when pause is pressed", "STEPS" },
+        { "idle-timeout", 0, 0, G_OPTION_ARG_INT, &idle_timeout, "Exit after this long without a gamepad, 0 to keep running (default)", "SECONDS" },
+        { NULL, 0, 0, 0, NULL, NULL, NULL }
+    };
+
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_set_summary(context,
+        "Macro steps are comma separated: \"A\" or \"A:40\" presses a button for that many ms,\n"
+        "\"A+B\" presses several at once and \"_:100\" waits.");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    gboolean ok = g_option_context_parse(context, argc, argv, error);
+    if (ok && idle_timeout < 0) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--idle-timeout must not be negative");
+        ok = FALSE;
+    }
+    if (ok && turbo_period < TURBO_MIN_PERIOD_MS) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "--turbo-period must be at least %d", TURBO_MIN_PERIOD_MS);
+        ok = FALSE;
+    }
+    ok = ok && (!turbo || turbo_add_buttons(turbo, turbo_period, error));
+    ok = ok && (!macro_l1 || turbo_add_macro(BTN_TL, macro_l1, error));
+    ok = ok && (!macro_r1 || turbo_add_macro(BTN_TR, macro_r1, error));
+    ok = ok && (!macro_start || turbo_add_macro(BTN_START, macro_start, error));
+
+    g_free(turbo);
+    g_free(macro_l1);
+    g_free(macro_r1);
+    g_free(macro_start);
+    g_option_context_free(context);
+    return ok;
+}
+
 int main(int argc, char *argv[]) {
-    (void)argc; (void)argv;
+    GError *error = NULL;
+    launch_time = g_get_monotonic_time();
+
+    if (!parse_options(&argc, &argv, &error) || !turbo_init(&error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
     
     g_message("Starting Skylanders GamePad Daemon\n");
 
@@ -441,8 +715,6 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
-    GError *error = NULL;
-    
     // Connect to BlueZ via D-Bus
     conn = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
     if (!conn) {
@@ -453,10 +725,9 @@ int main(int argc, char *argv[]) {
     
     g_message("Connected to D-Bus\n");
 
-    g_message("Checking if device is already connected...\n");
-    // Check if device is already connected
-    check_initial_connection_state();
-        
+    bus_init();
+
+    // Subscribe before the initial check so a gamepad that connects (or gets its name) while we look isn't missed
     g_dbus_connection_signal_subscribe(conn,
         "org.bluez",
         "org.freedesktop.DBus.Properties",
@@ -467,17 +738,47 @@ int main(int argc, char *argv[]) {
         on_bluez_properties_changed,
         NULL,
         NULL);
+    g_dbus_connection_signal_subscribe(conn,
+        "org.bluez",
+        "org.freedesktop.DBus.Properties",
+        "PropertiesChanged",
+        NULL, // every device, filtered to /org/bluez in the handler
+        "org.bluez.Device1",
+        G_DBUS_SIGNAL_FLAGS_NONE,
+        on_any_device_properties_changed,
+        NULL,
+        NULL);
+    g_dbus_connection_signal_subscribe(conn,
+        "org.bluez",
+        "org.freedesktop.DBus.ObjectManager",
+        "InterfacesAdded",
+        "/",
+        NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE,
+        on_bluez_interfaces_added,
+        NULL,
+        NULL);
     g_message("Monitoring for new devices.\n");
+
+    g_message("Checking if device is already connected...\n");
+    // Check if device is already connected
+    check_initial_connection_state();
+    if (!device_connected) {
+        update_idle_timer();
+    }
     
     // Run daemon
     main_loop = g_main_loop_new(NULL, FALSE);
     
-    g_message("Daemon running.\n");
+    g_message("Daemon running, ready %.1f ms after launch.\n", (g_get_monotonic_time() - launch_time) / 1000.0);
     
     g_main_loop_run(main_loop);
     
     // Cleanup
     cleanup_virtual_gamepad();
+    turbo_shutdown();
+    g_hash_table_destroy(subscriptions);
+    bus_shutdown();
     if (conn) {
         g_object_unref(conn);
     }
@@ -9,12 +9,36 @@
 // --- Constants ---
 #define DEVICE_NAME "Skylanders GamePad"
 #define CHARACTERISTIC_UUID "533e1541-3abe-f33f-cd00-594e8b0a8ea3"
+#define SERVICES_RESOLVED_TIMEOUT_MS 2000
+#define SERVICES_RESOLVED_POLL_MS 50
+
+#define REPORT_MAX_SIZE 32
 
 // --- Structs ---
+// Only the asynchronous steps (RestartNotify, Reconnect) can be seen over D-Bus, the connection path itself is synchronous
+typedef enum {
+    STAGE_SUBSCRIBING,
+    STAGE_READY,
+    STAGE_RECONNECTING,
+    STAGE_NOTIFY_FAILED,
+} ConnectionStage;
+
 typedef struct {
     char *device_path;
+    char *object_path; // exported on our bus name, see bus.c
     guint characteristic_properties_changed_id;
     guint disconnected_id;
+    ConnectionStage stage;
+
+    // Report counters. These are only bumped on the report path, rates are worked out when read over D-Bus
+    guint64 reports_received;
+    guint64 duplicates_skipped;
+    gint64 last_report_time; // monotonic, connection time until the first report
+    gint64 rate_second;
+    guint rate_current;  // reports so far in rate_second
+    guint rate_previous; // reports in the second before it
+    guchar last_report[REPORT_MAX_SIZE];
+    gsize last_report_size;
 } GamepadSubscription;
 
 // --- Global Variables ---
@@ -28,6 +52,7 @@ extern GHashTable *subscriptions;
 // Gamepad Subscriptions
 GamepadSubscription *subscribe_gamepad(const char *device_path);
 void gamepad_subscription_free(GamepadSubscription *sub);
+gboolean gamepad_subscription_record_report(GamepadSubscription *sub, const guchar *data, gsize size);
 
 // --- BlueZ Helpers ---
 char *find_gamepad_device_path(void);
@@ -36,6 +61,12 @@ char *find_characteristic_path(const char *device_path, const char *uuid);
 // --- Device Connection ---
 void handle_device_connection_change(gboolean connected);
 void check_initial_connection_state(void);
+gboolean wait_for_services_resolved(const char *device_path);
+gboolean start_notify(const char *char_path, GError **error);
+
+// --- Idle Handling ---
+void update_idle_timer(void);
+long current_rss_kb(void);
 
 // --- D-Bus Signal Handlers ---
 void on_characteristic_properties_changed(GDBusConnection *connection,
@@ -62,6 +93,22 @@ void on_bluez_properties_changed(GDBusConnection *connection,
                                  GVariant *parameters,
                                  gpointer user_data);
 
+void on_any_device_properties_changed(GDBusConnection *connection,
+                                      const gchar *sender_name,
+                                      const gchar *object_path,
+                                      const gchar *interface_name,
+                                      const gchar *signal_name,
+                                      GVariant *parameters,
+                                      gpointer user_data);
+
+void on_bluez_interfaces_added(GDBusConnection *connection,
+                               const gchar *sender_name,
+                               const gchar *object_path,
+                               const gchar *interface_name,
+                               const gchar *signal_name,
+                               GVariant *parameters,
+                               gpointer user_data);
+
 // --- Signal Handler ---
 void signal_handler(int sig);
 
@@ -0,0 +1,176 @@
+#include "timerwheel.h"
+#include <stddef.h>
+#include <string.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_SLOT_BITS)
+// Furthest ahead the top level can hold, anything later is parked there and re-filed when it cascades
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+static inline uint64_t rotate_right(uint64_t bits, unsigned int n) {
+    n &= 63;
+    return n ? (bits >> n) | (bits << (64 - n)) : bits;
+}
+
+static void unlink_entry(TimerWheel *wheel, TimerWheelEntry *entry) {
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+    wheel->count--;
+
+    if (!wheel->slots[entry->level][entry->slot]) {
+        wheel->occupied[entry->level] &= ~(1ULL << entry->slot);
+    }
+}
+
+static void insert_entry(TimerWheel *wheel, TimerWheelEntry *entry) {
+    uint64_t expires = entry->expires < wheel->now ? wheel->now : entry->expires;
+    uint64_t delta = expires - wheel->now;
+    unsigned int level = 0;
+
+    if (delta > MAX_DELTA) {
+        expires = wheel->now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+    while (delta >> LEVEL_SHIFT(level + 1)) {
+        level++;
+    }
+
+    unsigned int slot = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    TimerWheelEntry **head = &wheel->slots[level][slot];
+
+    entry->level = level;
+    entry->slot = slot;
+    entry->next = *head;
+    entry->pprev = head;
+    if (*head) {
+        (*head)->pprev = &entry->next;
+    }
+    *head = entry;
+
+    wheel->occupied[level] |= 1ULL << slot;
+    wheel->count++;
+}
+
+// Take a whole slot off the wheel. The detached list stays doubly linked through *list so
+// entries on it can still be cancelled while it is being walked.
+static void detach_slot(TimerWheel *wheel, unsigned int level, unsigned int slot, TimerWheelEntry **list) {
+    *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    if (*list) {
+        (*list)->pprev = list;
+    }
+}
+
+static void cascade(TimerWheel *wheel, unsigned int level) {
+    TimerWheelEntry *list;
+    detach_slot(wheel, level, (wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK, &list);
+
+    while (list) {
+        TimerWheelEntry *entry = list;
+        unlink_entry(wheel, entry);
+        insert_entry(wheel, entry);
+    }
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void timer_wheel_entry_init(TimerWheelEntry *entry, TimerWheelCallback callback, void *user_data) {
+    memset(entry, 0, sizeof(*entry));
+    entry->callback = callback;
+    entry->user_data = user_data;
+}
+
+bool timer_wheel_entry_pending(const TimerWheelEntry *entry) {
+    return entry->pprev != NULL;
+}
+
+void timer_wheel_schedule(TimerWheel *wheel, TimerWheelEntry *entry, uint64_t expires) {
+    if (timer_wheel_entry_pending(entry)) {
+        unlink_entry(wheel, entry);
+    }
+    entry->expires = expires;
+    insert_entry(wheel, entry);
+}
+
+void timer_wheel_cancel(TimerWheel *wheel, TimerWheelEntry *entry) {
+    if (timer_wheel_entry_pending(entry)) {
+        unlink_entry(wheel, entry);
+    }
+}
+
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now) {
+    while (wheel->now <= now) {
+        if (wheel->count == 0) {
+            // Nothing to fire or cascade, just catch the clock up
+            wheel->now = now + 1;
+            return;
+        }
+
+        if ((wheel->now & SLOT_MASK) == 0) {
+            for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                cascade(wheel, level);
+                if ((wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK) {
+                    break;
+                }
+            }
+        }
+
+        TimerWheelEntry *list;
+        detach_slot(wheel, 0, wheel->now & SLOT_MASK, &list);
+        // Move on before firing so anything rescheduled for "now" lands on the next tick, not a full turn later
+        wheel->now++;
+
+        while (list) {
+            TimerWheelEntry *entry = list;
+            unlink_entry(wheel, entry);
+            entry->callback(entry, entry->user_data);
+        }
+
+        // Skip empty level 0 slots up to the next occupied one or the next cascade
+        unsigned int index = wheel->now & SLOT_MASK;
+        if (index != 0 && wheel->now <= now) {
+            uint64_t ahead = wheel->occupied[0] & (~0ULL << index);
+            uint64_t next = ahead ? (wheel->now & ~(uint64_t)SLOT_MASK) | (uint64_t)__builtin_ctzll(ahead)
+                                  : (wheel->now | SLOT_MASK) + 1;
+            wheel->now = next < now + 1 ? next : now + 1;
+        }
+    }
+}
+
+bool timer_wheel_next_deadline(const TimerWheel *wheel, uint64_t *deadline) {
+    if (wheel->count == 0) {
+        return false;
+    }
+
+    uint64_t best = UINT64_MAX;
+
+    if (wheel->occupied[0]) {
+        uint64_t bits = rotate_right(wheel->occupied[0], wheel->now & SLOT_MASK);
+        best = wheel->now + __builtin_ctzll(bits);
+    }
+
+    for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!wheel->occupied[level]) {
+            continue;
+        }
+        // First boundary of this level at or after now, then the first occupied slot from there on
+        unsigned int shift = LEVEL_SHIFT(level);
+        uint64_t boundary = (wheel->now + (1ULL << shift) - 1) >> shift;
+        uint64_t bits = rotate_right(wheel->occupied[level], boundary & SLOT_MASK);
+        uint64_t cascade_at = (boundary + __builtin_ctzll(bits)) << shift;
+        if (cascade_at < best) {
+            best = cascade_at;
+        }
+    }
+
+    *deadline = best;
+    return true;
+}
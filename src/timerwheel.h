@@ -0,0 +1,49 @@
+#ifndef SKYLANDERS_TIMERWHEEL_H
+#define SKYLANDERS_TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel with a 1ms tick. Level 0 covers the next 64ms exactly,
+// every level above covers 64x the range of the one below and gets cascaded down
+// as time reaches it. Entries are intrusive, so scheduling never allocates.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct TimerWheelEntry TimerWheelEntry;
+typedef void (*TimerWheelCallback)(TimerWheelEntry *entry, void *user_data);
+
+struct TimerWheelEntry {
+    TimerWheelEntry *next;
+    TimerWheelEntry **pprev; // NULL when the entry is not scheduled
+    uint64_t expires;        // absolute time in ms
+    uint8_t level;
+    uint8_t slot;
+    TimerWheelCallback callback;
+    void *user_data;
+};
+
+typedef struct {
+    uint64_t now; // next tick that has not been processed yet
+    unsigned int count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // bit n set when slot n is non-empty
+    TimerWheelEntry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now);
+void timer_wheel_entry_init(TimerWheelEntry *entry, TimerWheelCallback callback, void *user_data);
+bool timer_wheel_entry_pending(const TimerWheelEntry *entry);
+
+// Schedule (or reschedule) entry to fire at the absolute time expires. Times in the past fire on the next tick.
+void timer_wheel_schedule(TimerWheel *wheel, TimerWheelEntry *entry, uint64_t expires);
+void timer_wheel_cancel(TimerWheel *wheel, TimerWheelEntry *entry);
+
+// Fire every entry that expires at or before now. Callbacks may schedule and cancel entries.
+void timer_wheel_advance(TimerWheel *wheel, uint64_t now);
+
+// Time at which the wheel next needs to be advanced, either to fire an entry or to cascade a higher level.
+// Returns false when nothing is scheduled.
+bool timer_wheel_next_deadline(const TimerWheel *wheel, uint64_t *deadline);
+
+#endif // SKYLANDERS_TIMERWHEEL_H
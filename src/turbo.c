@@ -0,0 +1,433 @@
+// Turbo (auto-repeat) and macro engine, driven by a single timerfd backed timer wheel
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "turbo.h"
+#include "gamepad.h"
+#include "timerwheel.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <glib-unix.h>
+#include <libevdev/libevdev-uinput.h>
+
+typedef struct {
+    unsigned int code;
+    guint period;   // full press + release cycle in ms
+    gboolean held;  // physical button is down
+    gboolean down;  // state last written to the virtual gamepad
+    TimerWheelEntry timer;
+} TurboButton;
+
+typedef struct {
+    unsigned int codes[MACRO_STEP_MAX_KEYS];
+    guint n_codes;
+    int value;
+    guint delay; // ms until the next action
+} MacroAction;
+
+typedef struct {
+    unsigned int trigger;
+    GArray *actions; // MacroAction
+    guint next_action;
+    gboolean running;
+    TimerWheelEntry timer;
+} Macro;
+
+static const struct {
+    const char *name;
+    unsigned int code;
+} button_names[] = {
+    { "A", BTN_A }, { "B", BTN_B }, { "X", BTN_X }, { "Y", BTN_Y },
+    { "L1", BTN_TL }, { "R1", BTN_TR }, { "L2", BTN_TL2 }, { "R2", BTN_TR2 },
+    { "UP", BTN_DPAD_UP }, { "DOWN", BTN_DPAD_DOWN }, { "LEFT", BTN_DPAD_LEFT }, { "RIGHT", BTN_DPAD_RIGHT },
+    { "START", BTN_START }, { "SELECT", BTN_SELECT },
+};
+
+static GPtrArray *turbo_buttons = NULL; // TurboButton*
+static GPtrArray *macros = NULL;        // Macro*
+
+static TimerWheel wheel;
+static int timer_fd = -1;
+static guint timer_source_id = 0;
+static guint64 armed_deadline = 0; // 0 while the timerfd is disarmed
+static guint64 expired_at = 0;     // time the timerfd was last handled, callbacks may be running behind it
+
+static guint64 now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64)ts.tv_sec * 1000 + (guint64)ts.tv_nsec / 1000000;
+}
+
+static gboolean lookup_button(const char *name, unsigned int *code) {
+    for (size_t i = 0; i < G_N_ELEMENTS(button_names); i++) {
+        if (g_ascii_strcasecmp(button_names[i].name, name) == 0) {
+            *code = button_names[i].code;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Parses "NAME" or "NAME:MS", leaving ms untouched if no duration was given
+static gboolean parse_timed_token(const char *token, char **name, guint *ms, GError **error) {
+    const char *colon = strchr(token, ':');
+    if (!colon) {
+        *name = g_strstrip(g_strdup(token));
+        return TRUE;
+    }
+
+    char *duration = g_strstrip(g_strdup(colon + 1));
+    guint64 value;
+    gboolean valid = g_ascii_string_to_unsigned(duration, 10, 1, G_MAXUINT, &value, NULL);
+    g_free(duration);
+    if (!valid) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Invalid duration in \"%s\"", token);
+        return FALSE;
+    }
+    *name = g_strstrip(g_strndup(token, colon - token));
+    *ms = (guint)value;
+    return TRUE;
+}
+
+static TurboButton *find_turbo_button(unsigned int code) {
+    if (!turbo_buttons) return NULL;
+    for (guint i = 0; i < turbo_buttons->len; i++) {
+        TurboButton *turbo = g_ptr_array_index(turbo_buttons, i);
+        if (turbo->code == code) return turbo;
+    }
+    return NULL;
+}
+
+static Macro *find_macro(unsigned int trigger) {
+    if (!macros) return NULL;
+    for (guint i = 0; i < macros->len; i++) {
+        Macro *macro = g_ptr_array_index(macros, i);
+        if (macro->trigger == trigger) return macro;
+    }
+    return NULL;
+}
+
+static void macro_free(Macro *macro) {
+    g_array_unref(macro->actions);
+    g_free(macro);
+}
+
+// Keep the timerfd pointed at the wheel's next deadline, or disarmed when nothing is scheduled
+static void rearm_timer(void) {
+    guint64 deadline = 0;
+    if (!timer_wheel_next_deadline(&wheel, &deadline)) {
+        deadline = 0;
+    }
+    if (deadline == armed_deadline) {
+        return;
+    }
+
+    struct itimerspec spec = { 0 };
+    spec.it_value.tv_sec = deadline / 1000;
+    spec.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        g_warning("Failed to arm turbo timer: %s\n", g_strerror(errno));
+        return;
+    }
+    armed_deadline = deadline;
+}
+
+// Schedule relative to the wall clock. A wheel that has been empty was left behind while the
+// timerfd was disarmed, so catch it up first.
+static void schedule(TimerWheelEntry *entry, guint64 now, guint64 expires) {
+    if (wheel.count == 0) {
+        timer_wheel_advance(&wheel, now - 1);
+    }
+    timer_wheel_schedule(&wheel, entry, expires);
+}
+
+static void write_keys(const unsigned int *codes, guint n_codes, int value) {
+    for (guint i = 0; i < n_codes; i++) {
+        write_event(EV_KEY, codes[i], value);
+    }
+}
+
+static void on_turbo_timer(TimerWheelEntry *entry, void *user_data) {
+    TurboButton *turbo = user_data;
+
+    turbo->down = !turbo->down;
+    write_event(EV_KEY, turbo->code, turbo->down);
+    write_event(EV_SYN, SYN_REPORT, 0);
+
+    // Chain off the previous deadline rather than the current time so the period never drifts. After a
+    // main loop stall, drop the whole periods that were missed instead of replaying them all at once.
+    guint half = turbo->down ? turbo->period / 2 : turbo->period - turbo->period / 2;
+    guint64 next = entry->expires + half;
+    if (next < expired_at) {
+        next += (expired_at - next + turbo->period - 1) / turbo->period * turbo->period;
+    }
+    timer_wheel_schedule(&wheel, entry, next);
+}
+
+static void on_macro_timer(TimerWheelEntry *entry, void *user_data) {
+    Macro *macro = user_data;
+
+    // The last action's delay (its release gap plus any trailing wait) has passed, the macro can run again
+    if (macro->next_action >= macro->actions->len) {
+        macro->running = FALSE;
+        return;
+    }
+
+    MacroAction *action = &g_array_index(macro->actions, MacroAction, macro->next_action++);
+    write_keys(action->codes, action->n_codes, action->value);
+    write_event(EV_SYN, SYN_REPORT, 0);
+    // Steps missed during a main loop stall would all land in the same millisecond, start timing again from now
+    guint64 next = entry->expires + action->delay;
+    if (next < expired_at) {
+        next = expired_at + action->delay;
+    }
+    timer_wheel_schedule(&wheel, entry, next);
+}
+
+static gboolean on_timer_expired(gint fd, GIOCondition condition, gpointer user_data) {
+    (void)condition; (void)user_data;
+
+    guint64 expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        g_warning("Failed to read turbo timer: %s\n", g_strerror(errno));
+    }
+
+    armed_deadline = 0; // one-shot, the kernel disarmed it
+    expired_at = now_ms();
+    timer_wheel_advance(&wheel, expired_at);
+    rearm_timer();
+    return G_SOURCE_CONTINUE;
+}
+
+// Turbo spec: comma separated buttons, each optionally with its own period, e.g. "A,B:80,X"
+gboolean turbo_add_buttons(const char *spec, guint default_period, GError **error) {
+    gchar **tokens = g_strsplit(spec, ",", -1);
+    gboolean ok = TRUE;
+
+    if (!turbo_buttons) {
+        turbo_buttons = g_ptr_array_new_with_free_func(g_free);
+    }
+
+    for (gchar **token = tokens; *token && ok; token++) {
+        char *name = NULL;
+        guint period = default_period;
+        unsigned int code;
+
+        if (!parse_timed_token(*token, &name, &period, error)) {
+            ok = FALSE;
+        } else if (!lookup_button(name, &code)) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown button \"%s\"", name);
+            ok = FALSE;
+        } else if (period < TURBO_MIN_PERIOD_MS) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Turbo period for %s must be at least %d ms", name, TURBO_MIN_PERIOD_MS);
+            ok = FALSE;
+        } else {
+            TurboButton *turbo = find_turbo_button(code);
+            if (!turbo) {
+                turbo = g_new0(TurboButton, 1);
+                turbo->code = code;
+                timer_wheel_entry_init(&turbo->timer, on_turbo_timer, turbo);
+                g_ptr_array_add(turbo_buttons, turbo);
+            }
+            turbo->period = period;
+        }
+        g_free(name);
+    }
+
+    g_strfreev(tokens);
+    return ok;
+}
+
+// Macro spec: comma separated steps run in order. "A" or "A:40" presses a button for the given
+// time (default MACRO_DEFAULT_HOLD_MS) and leaves it released for as long again, "A+B" presses
+// several at once and "_:100" just waits. The macro counts as running until its final delay is over,
+// so a trailing wait acts as a cooldown before the trigger works again.
+gboolean turbo_add_macro(unsigned int trigger_code, const char *spec, GError **error) {
+    gchar **tokens = g_strsplit(spec, ",", -1);
+    GArray *actions = g_array_new(FALSE, TRUE, sizeof(MacroAction));
+    gboolean ok = TRUE;
+
+    for (gchar **token = tokens; *token && ok; token++) {
+        char *names = NULL;
+        guint hold = MACRO_DEFAULT_HOLD_MS;
+
+        if (!parse_timed_token(*token, &names, &hold, error)) {
+            ok = FALSE;
+            break;
+        }
+
+        if (strcmp(names, "_") == 0) {
+            if (actions->len == 0) {
+                MacroAction wait = { .delay = hold };
+                g_array_append_val(actions, wait);
+            } else {
+                g_array_index(actions, MacroAction, actions->len - 1).delay += hold;
+            }
+            g_free(names);
+            continue;
+        }
+
+        MacroAction press = { .value = 1, .delay = hold };
+        gchar **keys = g_strsplit(names, "+", -1);
+        for (gchar **key = keys; *key; key++) {
+            if (press.n_codes == MACRO_STEP_MAX_KEYS) {
+                g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "Macro step \"%s\" has more than %d buttons", *token, MACRO_STEP_MAX_KEYS);
+                ok = FALSE;
+                break;
+            }
+            if (!lookup_button(g_strstrip(*key), &press.codes[press.n_codes++])) {
+                g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Unknown button \"%s\"", *key);
+                ok = FALSE;
+                break;
+            }
+        }
+        g_strfreev(keys);
+        g_free(names);
+
+        if (ok) {
+            MacroAction release = press;
+            release.value = 0;
+            g_array_append_val(actions, press);
+            g_array_append_val(actions, release);
+        }
+    }
+    g_strfreev(tokens);
+
+    if (ok && actions->len == 0) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Macro is empty");
+        ok = FALSE;
+    }
+    if (!ok) {
+        g_array_unref(actions);
+        return FALSE;
+    }
+
+    if (!macros) {
+        macros = g_ptr_array_new_with_free_func((GDestroyNotify)macro_free);
+    }
+
+    Macro *macro = find_macro(trigger_code);
+    if (macro) {
+        g_array_unref(macro->actions);
+    } else {
+        macro = g_new0(Macro, 1);
+        macro->trigger = trigger_code;
+        timer_wheel_entry_init(&macro->timer, on_macro_timer, macro);
+        g_ptr_array_add(macros, macro);
+    }
+    macro->actions = actions;
+    return TRUE;
+}
+
+gboolean turbo_init(GError **error) {
+    if ((!turbo_buttons || turbo_buttons->len == 0) && (!macros || macros->len == 0)) {
+        return TRUE; // nothing bound, no timer needed
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Failed to create turbo timer: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    timer_wheel_init(&wheel, now_ms());
+    timer_source_id = g_unix_fd_add(timer_fd, G_IO_IN, on_timer_expired, NULL);
+
+    g_message("Turbo enabled on %u button(s), %u macro(s) bound\n",
+              turbo_buttons ? turbo_buttons->len : 0, macros ? macros->len : 0);
+    return TRUE;
+}
+
+void turbo_shutdown(void) {
+    turbo_reset();
+
+    if (timer_source_id) {
+        g_source_remove(timer_source_id);
+        timer_source_id = 0;
+    }
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    g_clear_pointer(&turbo_buttons, g_ptr_array_unref);
+    g_clear_pointer(&macros, g_ptr_array_unref);
+}
+
+gboolean turbo_handle_button(unsigned int code, int value) {
+    if (timer_fd < 0) {
+        return FALSE;
+    }
+
+    Macro *macro = find_macro(code);
+    if (macro) {
+        // The trigger itself is swallowed, a press starts the macro unless it is already running
+        if (value && !macro->running && macro->actions->len > 0) {
+            MacroAction *first = &g_array_index(macro->actions, MacroAction, 0);
+            guint64 now = now_ms();
+
+            // The first action goes out with the report that triggered it
+            write_keys(first->codes, first->n_codes, first->value);
+            macro->next_action = 1;
+            macro->running = TRUE;
+            schedule(&macro->timer, now, now + first->delay);
+            rearm_timer();
+        }
+        return TRUE;
+    }
+
+    TurboButton *turbo = find_turbo_button(code);
+    if (!turbo) {
+        return FALSE;
+    }
+
+    if (value) {
+        if (turbo->held) {
+            return TRUE;
+        }
+        guint64 now = now_ms();
+        turbo->held = TRUE;
+        turbo->down = TRUE;
+        schedule(&turbo->timer, now, now + turbo->period / 2);
+        rearm_timer();
+        return FALSE; // let the initial press through with this report
+    }
+
+    if (!turbo->held) {
+        return TRUE;
+    }
+    turbo->held = FALSE;
+    timer_wheel_cancel(&wheel, &turbo->timer);
+    rearm_timer();
+
+    if (turbo->down) {
+        turbo->down = FALSE;
+        return FALSE; // let the release through
+    }
+    return TRUE; // already released by the timer
+}
+
+void turbo_reset(void) {
+    if (timer_fd < 0) {
+        return;
+    }
+
+    for (guint i = 0; turbo_buttons && i < turbo_buttons->len; i++) {
+        TurboButton *turbo = g_ptr_array_index(turbo_buttons, i);
+        timer_wheel_cancel(&wheel, &turbo->timer);
+        turbo->held = FALSE;
+        turbo->down = FALSE;
+    }
+    for (guint i = 0; macros && i < macros->len; i++) {
+        Macro *macro = g_ptr_array_index(macros, i);
+        timer_wheel_cancel(&wheel, &macro->timer);
+        macro->running = FALSE;
+    }
+    rearm_timer();
+}
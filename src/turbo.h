@@ -0,0 +1,26 @@
+#ifndef SKYLANDERS_TURBO_H
+#define SKYLANDERS_TURBO_H
+
+#include <glib.h>
+
+#define TURBO_DEFAULT_PERIOD_MS 100
+#define TURBO_MIN_PERIOD_MS 2
+#define MACRO_DEFAULT_HOLD_MS 50
+#define MACRO_STEP_MAX_KEYS 4
+
+// Bindings, parsed from the command line before turbo_init()
+gboolean turbo_add_buttons(const char *spec, guint default_period, GError **error);
+gboolean turbo_add_macro(unsigned int trigger_code, const char *spec, GError **error);
+
+// Creates the timerfd and hooks it into the default main context, only if something is bound
+gboolean turbo_init(GError **error);
+void turbo_shutdown(void);
+
+// Called from the report path for every button edge. Returns TRUE if the engine took over the
+// event and it must not be written to the virtual gamepad.
+gboolean turbo_handle_button(unsigned int code, int value);
+
+// Drop everything scheduled, used when the virtual gamepad goes away
+void turbo_reset(void);
+
+#endif // SKYLANDERS_TURBO_H